@@ -10,7 +10,10 @@
     * least 1 second, each iteration, to ensure that the main
     * thread can lock the mutex to add new work to the list.
     */
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <time.h>
 #include "errors.h"
 
@@ -26,67 +29,468 @@ typedef struct alarm_tag
     struct alarm_tag *link;
     int id;
     int seconds;
+    int priority; /* PRIORITY_HIGH or PRIORITY_NORMAL */
     time_t time; /* seconds from EPOCH */
     char message[128];
     int Changed;
+    time_t printed;  /* last periodic message, 0 until picked up */
+    int trace_id;    /* unique id of the alarm's trace spans */
+    long submitted;  /* trace time the command was read */
+    long queued;     /* trace time the alarm was put on a list */
+    long dispatched; /* trace time of the hand-off to a display thread */
+    long picked;     /* trace time a display thread picked it up */
 } alarm_t;
 
-//Mutex for alarm_thread
+/*
+    * Alarms are kept in one list per priority level, so that an
+    * urgent alarm is never queued behind bulk ones. Priority 0 is
+    * the most urgent.
+    */
+#define PRIORITY_HIGH 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_LEVELS 2
+
+/*
+    * Each display thread has its own queue of alarms, sorted by
+    * expiry time, protected by its own mutex. A display thread
+    * displays all alarms on its queue at once and sleeps only
+    * until the next expiry or periodic message, so a long alarm
+    * never holds up a later one. Display threads 0-2 are shared
+    * by normal alarms, the last one is reserved for PRIORITY_HIGH
+    * alarms. No thread writes to stdout while holding a mutex, so
+    * a busy shared display thread cannot hold up the reserved one.
+    */
+typedef struct display_tag
+{
+    pthread_mutex_t mutex; /* protects alarms */
+    pthread_cond_t cond;   /* signaled when the queue changes */
+    alarm_t *alarms;       /* alarms being displayed, soonest first */
+} display_t;
+
+#define DISPLAY_SHARED 3
+#define DISPLAY_RESERVED DISPLAY_SHARED
+#define DISPLAY_THREADS (DISPLAY_SHARED + 1)
+
+//Mutex for the alarm lists. A thread holding it may go on to
+//lock a display thread's mutex, never the other way round.
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-//conditional checks to see when a certain thread needs to run
-pthread_cond_t d1_cond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t d2_cond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t d3_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;    //Main alarm list
-alarm_t *current_alarm = NULL; //current alarm
+alarm_t *alarm_list[PRIORITY_LEVELS]; //Main alarm lists, one per priority
 
-//Takes in the current alarm_list and the new alarm
-//that needs to be inserted
-//Insert to the list, sorted by smallest id;
-void Insert(alarm_t **last, alarm_t *new)
+//Display queues, each allocated by its own display thread
+display_t *display[DISPLAY_THREADS];
+//Lets main wait until every display thread has set up its queue
+pthread_barrier_t display_barrier;
+
+/*
+    * Optional lifecycle tracing, enabled with -t. Each thread
+    * records timestamped spans into its own ring buffer, so
+    * recording takes no lock, and once a buffer is full the
+    * oldest spans are overwritten. Work done by one thread is
+    * recorded as a slice on that thread. The life of each alarm,
+    * which passes between threads, is recorded as async spans
+    * that share the alarm's trace_id. The Trace_Dump command
+    * writes all buffers out in Chrome trace format, which can be
+    * opened in a timeline viewer such as Perfetto.
+    */
+#define TRACE_EVENTS 4096
+#define TRACE_THREADS (DISPLAY_THREADS + 2)
+#define TRACE_MAIN 0
+#define TRACE_ALARM 1
+#define TRACE_DISPLAY 2 /* first display thread */
+
+typedef struct trace_event_tag
+{
+    const char *name;
+    int id;        /* alarm id, -1 if none */
+    int trace_id;  /* async span id, 0 for a slice on this thread */
+    long start;    /* microseconds since trace_epoch */
+    long duration; /* microseconds */
+} trace_event_t;
+
+typedef struct trace_buffer_tag
+{
+    const char *thread_name;
+    long count;    /* events ever recorded, published to Trace_Dump;
+                      event n is kept in event[n % TRACE_EVENTS] */
+    trace_event_t event[TRACE_EVENTS];
+} trace_buffer_t;
+
+int trace_enabled = 0;              //non-zero if -t was given
+struct timespec trace_epoch;        //time the trace started
+trace_buffer_t trace_buffer[TRACE_THREADS];
+__thread trace_buffer_t *trace_self; //this thread's buffer
+
+//Returns the trace time in microseconds, or 0 if tracing is off
+long Trace_Now(void)
+{
+    struct timespec now;
+
+    if (!trace_enabled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - trace_epoch.tv_sec) * 1000000L +
+           (now.tv_nsec - trace_epoch.tv_nsec) / 1000;
+}
+
+//Gives the calling thread its trace buffer
+void Trace_Thread(int index, const char *name)
+{
+    trace_buffer[index].thread_name = name;
+    trace_self = &trace_buffer[index];
+}
+
+//Records a span named name for alarm id, from start until end,
+//overwriting the oldest span once the buffer is full
+void Trace_Record(const char *name, int id, int trace_id,
+                  long start, long end)
+{
+    trace_buffer_t *buffer = trace_self;
+    trace_event_t *event;
+
+    if (!trace_enabled || buffer == NULL)
+        return;
+    //Trace_Dump must see count move past an old event before any
+    //of the stores that overwrite it
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event = &buffer->event[buffer->count % TRACE_EVENTS];
+    event->name = name;
+    event->id = id;
+    event->trace_id = trace_id;
+    event->start = start;
+    event->duration = end - start;
+    //publish the event only once it is complete
+    __atomic_store_n(&buffer->count, buffer->count + 1, __ATOMIC_RELEASE);
+}
+
+//Records a slice named name on this thread for alarm id, from
+//start until now
+void Trace_Span(const char *name, int id, long start)
+{
+    if (trace_enabled)
+        Trace_Record(name, id, 0, start, Trace_Now());
+}
+
+//Records a step named name in the life of alarm, from start
+//until end
+void Trace_Alarm(const char *name, alarm_t *alarm, long start, long end)
+{
+    if (trace_enabled)
+        Trace_Record(name, alarm->id, alarm->trace_id, start, end);
+}
+
+//Locks alarm_mutex or a display thread's mutex, recording the
+//time spent waiting for it. Only contended locks are recorded,
+//so idle threads do not fill their buffers.
+void Trace_Lock(pthread_mutex_t *mutex, int id)
 {
+    long start;
+    int status;
+
+    status = pthread_mutex_trylock(mutex);
+    if (status == 0)
+        return;
+    if (status != EBUSY)
+        err_abort(status, "Lock mutex");
+    start = Trace_Now();
+    status = pthread_mutex_lock(mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    Trace_Span(mutex == &alarm_mutex ? "wait alarm_mutex" : "wait display mutex",
+               id, start);
+}
 
-    alarm_t *old = *last;
+//Writes every trace buffer to file in Chrome trace format
+void Trace_Dump(const char *file)
+{
+    FILE *out;
+    trace_buffer_t *buffer;
+    trace_event_t event;
+    long count;
+    long oldest;
+    long j;
+    int first = 1;
+    int i;
 
-    while (*last != NULL)
+    out = fopen(file, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+        return;
+    }
+    fprintf(out, "{\"traceEvents\":[");
+    for (i = 0; i < TRACE_THREADS; i++)
     {
-        //if alarm id is smaller, append alarm in front of next
-        if (old->id >= new->id)
+        buffer = &trace_buffer[i];
+        if (buffer->thread_name == NULL)
+            continue;
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                     "\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", i, buffer->thread_name);
+        first = 0;
+
+        //Walk the ring from the oldest event to the newest
+        count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        oldest = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+        for (j = oldest; j < count; j++)
         {
-            //if alarm id same as current id
-            //check for seconds and append it before current
-            if(old->seconds >= new->seconds){
-                new->link = old;
-                *last = new;
-                new->Changed = 0;
-                break;
-            }
-            else{
-                last = &new->link;
-                new = new->link;
+            event = buffer->event[j % TRACE_EVENTS];
+            //skip the event if its owner has started to overwrite it
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&buffer->count, __ATOMIC_RELAXED) - TRACE_EVENTS >= j)
                 continue;
+            if (event.trace_id == 0)
+            {
+                fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                             "\"ts\":%ld,\"dur\":%ld,\"args\":{\"id\":%d}}",
+                        event.name, i, event.start, event.duration, event.id);
+            }
+            else
+            {
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"alarm\",\"ph\":\"b\",\"id\":%d,"
+                             "\"pid\":1,\"tid\":%d,\"ts\":%ld,\"args\":{\"id\":%d}}",
+                        event.name, event.trace_id, i, event.start, event.id);
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"alarm\",\"ph\":\"e\",\"id\":%d,"
+                             "\"pid\":1,\"tid\":%d,\"ts\":%ld}",
+                        event.name, event.trace_id, i, event.start + event.duration);
             }
+        }
+        if (oldest > 0)
+            fprintf(stderr, "Trace buffer of %s wrapped, %ld oldest events overwritten\n",
+                    buffer->thread_name, oldest);
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0)
+        fprintf(stderr, "Cannot write %s: %s\n", file, strerror(errno));
+    else
+        printf("Trace written to %s\n", file);
+}
+
+/*
+    * Startup placement policy for each thread role. The alarm
+    * thread and the display threads can each be pinned to a set
+    * of CPUs, and the alarm thread can be run under SCHED_FIFO
+    * so that the timer path is isolated from other load.
+    *
+    * Each display thread allocates its own display_t, and copies
+    * every alarm handed to it into memory it allocated itself.
+    * Memory is placed on the NUMA node of the thread that first
+    * touches it, so a display thread's queue is local to the cpus
+    * it is pinned to.
+    */
+typedef struct placement_tag
+{
+    int pin;        /* non-zero if cpus should be applied */
+    cpu_set_t cpus;
+} placement_t;
+
+placement_t alarm_placement;   //placement of the alarm thread
+placement_t display_placement; //placement of the display threads
+int alarm_priority = 0;        //SCHED_FIFO priority, 0 for default
+
+//Takes in a cpu list such as "0,2-3" and fills in cpus
+//Returns 0 on success and -1 if the list is malformed or names
+//a cpu this process is not allowed to run on
+int Parse_Cpus(const char *list, cpu_set_t *cpus)
+{
+    char buffer[128];
+    char *token;
+    char *save;
+    int first;
+    int last;
+    int used;
+    int cpu;
+    cpu_set_t allowed;
+    cpu_set_t usable;
+
+    if (strlen(list) >= sizeof(buffer))
+        return -1;
+    strcpy(buffer, list);
+    CPU_ZERO(cpus);
+
+    for (token = strtok_r(buffer, ",", &save); token != NULL;
+         token = strtok_r(NULL, ",", &save))
+    {
+        //a single cpu is a range of one, and nothing may follow
+        //the last number
+        if (sscanf(token, "%d-%d%n", &first, &last, &used) < 2 ||
+            token[used] != '\0')
+        {
+            if (sscanf(token, "%d%n", &first, &used) < 1 ||
+                token[used] != '\0')
+                return -1;
+            last = first;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+    }
+    if (CPU_COUNT(cpus) == 0)
+        return -1;
+
+    //every cpu must be online and allowed for this process,
+    //otherwise pthread_create fails later on
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+        errno_abort("Get cpu affinity");
+    CPU_AND(&usable, cpus, &allowed);
+    return CPU_EQUAL(&usable, cpus) ? 0 : -1;
+}
+
+//Creates a thread running routine(arg), pinned according to placement
+void Create_Thread(pthread_t *thread, void *(*routine)(void *), void *arg,
+                   placement_t *placement, const char *text)
+{
+    pthread_attr_t attr;
+    int status;
+
+    status = pthread_attr_init(&attr);
+    if (status != 0)
+        err_abort(status, "Init thread attributes");
+    if (placement->pin)
+    {
+        status = pthread_attr_setaffinity_np(
+            &attr, sizeof(cpu_set_t), &placement->cpus);
+        if (status != 0)
+            err_abort(status, "Set thread affinity");
+    }
+    status = pthread_create(thread, &attr, routine, arg);
+    if (status != 0)
+        err_abort(status, text);
+    status = pthread_attr_destroy(&attr);
+    if (status != 0)
+        err_abort(status, "Destroy thread attributes");
+}
 
+//Runs the alarm thread under SCHED_FIFO if a priority was given.
+//Unprivileged users are not allowed to do this, in which case the
+//alarm thread keeps the default policy.
+void Set_Alarm_Priority(pthread_t thread)
+{
+    struct sched_param param;
+    int status;
+
+    if (alarm_priority == 0)
+        return;
+    param.sched_priority = alarm_priority;
+    status = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if (status == EPERM)
+        fprintf(stderr, "SCHED_FIFO not permitted, alarm thread left at default priority\n");
+    else if (status != 0)
+        err_abort(status, "Set alarm thread priority");
+}
+
+//Reads the placement policy from the command line
+//  -a cpus      pin the alarm thread to cpus
+//  -d cpus      pin the display threads to cpus
+//  -p priority  run the alarm thread under SCHED_FIFO at priority
+//  -t           record lifecycle traces for Trace_Dump
+void Parse_Options(int argc, char *argv[])
+{
+    int option;
+    long priority;
+    char *end;
+
+    while ((option = getopt(argc, argv, "a:d:p:t")) != -1)
+    {
+        switch (option)
+        {
+        case 'a':
+            if (Parse_Cpus(optarg, &alarm_placement.cpus) != 0)
+                goto usage;
+            alarm_placement.pin = 1;
+            break;
+        case 'd':
+            if (Parse_Cpus(optarg, &display_placement.cpus) != 0)
+                goto usage;
+            display_placement.pin = 1;
+            break;
+        case 'p':
+            //nothing may follow the number
+            errno = 0;
+            priority = strtol(optarg, &end, 10);
+            if (errno != 0 || end == optarg || *end != '\0' ||
+                priority < sched_get_priority_min(SCHED_FIFO) ||
+                priority > sched_get_priority_max(SCHED_FIFO))
+                goto usage;
+            alarm_priority = (int)priority;
+            break;
+        case 't':
+            trace_enabled = 1;
+            clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+            break;
+        default:
+            goto usage;
         }
-        last = &new->link;
-        new = new->link;
     }
-    //Sets the new alarm to the last place in the linked list
-    if (*last == NULL)
+    if (optind == argc)
+        return;
+
+usage:
+    fprintf(stderr, "usage: %s [-a cpus] [-d cpus] [-p priority] [-t]\n", argv[0]);
+    exit(1);
+}
+
+/*
+    * Messages a thread produces while holding a mutex are
+    * formatted into a memory stream, and only written to stdout
+    * once the mutex is released.
+    */
+typedef struct output_tag
+{
+    FILE *stream;
+    char *text;
+    size_t size;
+} output_t;
+
+void Open_Output(output_t *output)
+{
+    output->stream = open_memstream(&output->text, &output->size);
+    if (output->stream == NULL)
+        errno_abort("Open memory stream");
+}
+
+//Writes the formatted messages to stdout and empties the stream
+void Write_Output(output_t *output)
+{
+    if (fflush(output->stream) != 0)
+        errno_abort("Flush memory stream");
+    if (output->size > 0)
+        fwrite(output->text, 1, output->size, stdout);
+    rewind(output->stream);
+}
+
+//Takes in an alarm list and the new alarm
+//that needs to be inserted
+//Insert to the list, sorted by smallest id, then smallest seconds
+void Insert(alarm_t **last, alarm_t *new, output_t *output)
+{
+    alarm_t *next = *last;
+
+    while (next != NULL)
     {
-        *last = new;
+        //if alarm id is smaller, or the same id with fewer
+        //seconds, insert the new alarm in front of next
+        if (next->id > new->id ||
+            (next->id == new->id && next->seconds >= new->seconds))
+            break;
+        last = &next->link;
+        next = next->link;
     }
+    new->link = next;
+    new->Changed = 0;
+    *last = new;
     //Gets the expiration time
     new->time = time(NULL) + new->seconds;
-    printf("Alarm(%d) Inserted by Main Thread Into %d Alarm list at %d: [\"%s\"]\n",
+    fprintf(output->stream, "Alarm(%d) Inserted by Main Thread Into %d Alarm list at %d: [\"%s\"]\n",
            new->id, pthread_self(), new->time, new->message);
 }
 
-//Takes in the current alarm_list and the alarm
+//Takes in an alarm list and the alarm
 //that needs to be changed
-//Changes the corresponding alarm
-void Change(alarm_t **old, alarm_t *new)
+//Changes the corresponding alarm and returns it, or NULL if
+//the list has no alarm with that id
+alarm_t *Change(alarm_t **old, alarm_t *new, output_t *output)
 {
 
     alarm_t *alarm = *old;
@@ -102,24 +506,79 @@ void Change(alarm_t **old, alarm_t *new)
             strcpy(alarm->message, new->message);
             alarm->seconds = new->seconds;
             alarm->time = time(NULL) + new->seconds;
-            new->Changed = 1;
-            printf("Alarm(%d) Changed at <%d>: %s\n", alarm->id, alarm->time, alarm->message);
+            alarm->Changed = 1;
+            fprintf(output->stream, "Alarm(%d) Changed at <%d>: %s\n", alarm->id, alarm->time, alarm->message);
             break;
         }
         //moves
         alarm = alarm->link;
     }
+    return alarm;
 }
+
+//Adds the alarm to a display thread's queue, sorted by
+//expiry time, and wakes the display thread up
+void Queue_Display(display_t *slot, alarm_t *alarm)
+{
+    alarm_t **last = &slot->alarms;
+    int status;
+
+    while (*last != NULL && (*last)->time <= alarm->time)
+        last = &(*last)->link;
+    alarm->link = *last;
+    *last = alarm;
+    status = pthread_cond_signal(&slot->cond);
+    if (status != 0)
+        err_abort(status, "Signal cond");
+}
+
+//Changes an alarm already handed to a display thread, and moves
+//it to its new place in that thread's queue
+//Returns 1 if the alarm was found
+int Change_Display(display_t *slot, alarm_t *new, output_t *output)
+{
+    alarm_t **last;
+    alarm_t *alarm;
+
+    alarm = Change(&slot->alarms, new, output);
+    if (alarm == NULL)
+        return 0;
+    for (last = &slot->alarms; *last != alarm; last = &(*last)->link)
+        ;
+    *last = alarm->link;
+    Queue_Display(slot, alarm);
+    return 1;
+}
+
+//Picks the display thread for the alarm.
+//PRIORITY_HIGH alarms go to the reserved display thread.
+//Otherwise the shared display thread is chosen by expiry time
+//time % 3 == 1 -->display one
+//time % 3 == 2 -->display two
+//time % 3 == 0 -->display three
+int Pick_Display(alarm_t *alarm)
+{
+    if (alarm->priority == PRIORITY_HIGH)
+        return DISPLAY_RESERVED;
+    return (alarm->time + 2) % 3;
+}
+
 /*
 * The alarm thread's start routine.
 */
 void *alarm_thread(void *arg)
 {
     alarm_t *alarm;
+    display_t *slot;
+    output_t output;
     int sleep_time;
-    time_t now;
+    int priority;
     int status;
-    pthread_t thread;
+    long start;
+    long pass;
+
+    Trace_Thread(TRACE_ALARM, "alarm thread");
+    Open_Output(&output);
     /*
     * Loop forever, processing commands. The alarm thread will
     * be disintegrated when the process exits.
@@ -127,220 +586,199 @@ void *alarm_thread(void *arg)
     while (1)
     {
         //locks
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Lock mutex");
+        Trace_Lock(&alarm_mutex, -1);
 
-        alarm = alarm_list;
         /*
-         * If the alarm list is empty, wait for one second. This
-         * allows the main thread to run, and read another
-         * command. If the list is not empty, remove the first
-         * item. Get the expiry time, and assign display thread
-         * 1 to process the alarm if the (expiry time % 3 == 1)
-         * if (expiry time % 3 == 2) assign it to display thread 2
-         * if (expiry time % 3 == 0) assign it to display thread 3
+         * Hand every alarm on the lists to its display thread,
+         * most urgent list first. Then wait for one second. This
+         * allows the main thread to run, and read another command.
          */
-        if (alarm == NULL)
+        sleep_time = 1;
+        pass = Trace_Now();
+        for (priority = PRIORITY_HIGH; priority < PRIORITY_LEVELS; priority++)
         {
-            sleep_time = 1;
-        }
-        else
-        {
-            //Depending on the time that alarm is due
-            //Send it to different displays
-            //time % 3 == 1 -->display_one
-            //time % 3 == 2 -->display_two
-            //time % 3 == 0 -->display_three
-            if(alarm->time % 3 == 1){
-                alarm_list = alarm->link;
-                current_alarm = alarm;
-                printf("Alarm Thread Created New Display Alarm Thread %d For Alarm(%d) at %d:%s\n", pthread_self(), alarm->id, alarm->time, alarm->message);
-                status = pthread_cond_signal(&d1_cond);
-                if (status != 0)
-                    err_abort(status, "Signal cond");
-            }
-            if(alarm->time % 3 == 2){
-                alarm_list = alarm->link;
-                current_alarm = alarm;
-                printf("Alarm Thread Created New Display Alarm Thread %d For Alarm(%d) at %d:%s\n", pthread_self(), alarm->id, alarm->time, alarm->message);
-                status = pthread_cond_signal(&d2_cond);
-                if (status != 0)
-                    err_abort(status, "Signal cond");
-            }
-            if(alarm->time % 3 == 0){
-                alarm_list = alarm->link;
-                current_alarm = alarm;
-                printf("Alarm Thread Created New Display Alarm Thread %d For Alarm(%d) at %d:%s\n", pthread_self(), alarm->id, alarm->time, alarm->message);
-                status = pthread_cond_signal(&d2_cond);
+            while ((alarm = alarm_list[priority]) != NULL)
+            {
+                //time spent on the list, mostly waiting for
+                //this thread's one-second sleep to end
+                Trace_Alarm("queued", alarm, alarm->queued, pass);
+                start = Trace_Now();
+                alarm_list[priority] = alarm->link;
+                alarm->printed = 0;
+                alarm->dispatched = start;
+                fprintf(output.stream, "Alarm Thread Created New Display Alarm Thread %d For Alarm(%d) at %d:%s\n", pthread_self(), alarm->id, alarm->time, alarm->message);
+                slot = display[Pick_Display(alarm)];
+                Trace_Lock(&slot->mutex, alarm->id);
+                Queue_Display(slot, alarm);
+                //the display thread owns the alarm once unlocked
+                Trace_Span("dispatch", alarm->id, start);
+                status = pthread_mutex_unlock(&slot->mutex);
                 if (status != 0)
-                    err_abort(status, "Signal cond");
+                    err_abort(status, "Unlock mutex");
             }
         }
         //unlocks
         status = pthread_mutex_unlock(&alarm_mutex);
         if (status != 0)
             err_abort(status, "Unlock mutex");
+        Write_Output(&output);
         sleep(sleep_time);
     }
 }
-//Display 1 start routine
+
+//Moves an alarm that main allocated into memory allocated by the
+//calling display thread, see the placement policy above
+alarm_t *Move_Alarm(alarm_t *alarm)
+{
+    alarm_t *copy;
+
+    copy = (alarm_t *)malloc(sizeof(alarm_t));
+    if (copy == NULL)
+        errno_abort("Allocate alarm");
+    memcpy(copy, alarm, sizeof(alarm_t));
+    free(alarm);
+    return copy;
+}
+
+//Display start routine, arg is the display thread's index
 void *display_thread(void *arg)
 {
+    int index = (int)(intptr_t)arg;
+    display_t *slot;
     alarm_t *alarm;
+    alarm_t *expired;
+    alarm_t **last;
+    output_t output;
+    struct timespec wake;
     int status;
     time_t now;
-    
+    time_t next;
+    long start;
+
+    Trace_Thread(TRACE_DISPLAY + index,
+                 index == DISPLAY_RESERVED ?
+                 "reserved display thread" : "display thread");
+    Open_Output(&output);
+
+    //Set up this thread's queue, then wait for the others
+    slot = (display_t *)malloc(sizeof(display_t));
+    if (slot == NULL)
+        errno_abort("Allocate display");
+    status = pthread_mutex_init(&slot->mutex, NULL);
+    if (status != 0)
+        err_abort(status, "Init mutex");
+    status = pthread_cond_init(&slot->cond, NULL);
+    if (status != 0)
+        err_abort(status, "Init cond");
+    slot->alarms = NULL;
+    display[index] = slot;
+    status = pthread_barrier_wait(&display_barrier);
+    if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+        err_abort(status, "Wait on barrier");
+    Trace_Lock(&slot->mutex, -1);
+
     //Loop forever, processing alarms. The display thread will
     //be disintegrated when the process exits.
     while (1)
     {
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
-        {
-            err_abort(status, "Lock mutex");
-        }
+        now = time(NULL);
 
-	    //Wait for the alarm thread to signal when an alarm is ready to be
-      	//procced.
-        status = pthread_cond_wait(&d1_cond, &alarm_mutex);
-        if (status != 0)
+        //Take the alarms that have expired off the queue
+        expired = NULL;
+        last = &expired;
+        while ((alarm = slot->alarms) != NULL && alarm->time <= now)
         {
-            err_abort(status, "wait on cond");
+            slot->alarms = alarm->link;
+            alarm->link = NULL;
+            *last = alarm;
+            last = &alarm->link;
         }
-        alarm = current_alarm;
 
-        //While the alarm has not expired, print a message every
-        //5 seconds
-        while (alarm->time > time(NULL))
+        //Print a message for every other alarm every 5 seconds
+        for (last = &slot->alarms; (alarm = *last) != NULL; last = &alarm->link)
         {
+            if (alarm->printed == 0)
+            {
+                alarm = Move_Alarm(alarm);
+                *last = alarm;
+                alarm->picked = Trace_Now();
+                Trace_Alarm("handoff", alarm, alarm->dispatched, alarm->picked);
+            }
+            if (alarm->printed + 5 > now)
+                continue;
+            alarm->printed = now;
             //Checks to see if the alarm has been changed
             //If it hasn't
             if(alarm->Changed == 0){
-                printf("Alarm(%d) Printed by Alarm Display Thread %d at %d : %s \n",
+                fprintf(output.stream, "Alarm(%d) Printed by Alarm Display Thread %d at %d : %s \n",
                     alarm->id,
                     pthread_self(),
-                    time(NULL),
+                    now,
                     alarm->message);
-                sleep(5);
             }
             //If alarm has been changed
             else{
-                printf("Display Thread %d Starts to Print Changed Message at %d : %s\n",
+                fprintf(output.stream, "Display Thread %d Starts to Print Changed Message at %d : %s\n",
                     pthread_self(),
                     alarm->time,
                     alarm->message);
-                sleep(5);
             }
         }
-        //Remove the alarm once it has expired and print a message
-        printf("Alarm Thread Removed Alarm(%d) at %d: %s\n",
-               alarm->id, time(NULL), alarm->message);
-        //unlocks
-        status = pthread_mutex_unlock(&alarm_mutex);
-        if (status != 0)
-        {
-            err_abort(status, "unlock mutex");
-        }
-        free(alarm);
-    }
-}
-//Display 2 start routine
-void *display_thread_two(void *arg)
-{
-    alarm_t *alarm;
-    int status;
-    time_t now;
 
-    //Loop forever, processing alarms. The display thread will
-    //be disintegrated when the process exits.
-    while (1)
-    {
-        status = pthread_mutex_lock(&alarm_mutex);
+        //unlocks, then removes the expired alarms and prints the
+        //messages without holding the mutex
+        status = pthread_mutex_unlock(&slot->mutex);
         if (status != 0)
         {
-            err_abort(status, "Lock mutex");
+            err_abort(status, "unlock mutex");
         }
-        //Wait for the alarm thread to signal when an alarm is ready to be
-      	//procced.
-        status = pthread_cond_wait(&d2_cond, &alarm_mutex);
-        if (status != 0)
+        while ((alarm = expired) != NULL)
         {
-            err_abort(status, "wait on cond");
+            start = Trace_Now();
+            expired = alarm->link;
+            printf("Alarm Thread Removed Alarm(%d) at %d: %s\n",
+                   alarm->id, now, alarm->message);
+            Trace_Span("fire", alarm->id, start);
+            start = Trace_Now();
+            Trace_Alarm("displayed", alarm, alarm->picked, start);
+            Trace_Alarm("alarm", alarm, alarm->submitted, start);
+            free(alarm);
         }
-        alarm = current_alarm;
+        Write_Output(&output);
+        Trace_Lock(&slot->mutex, -1);
 
-        //While the alarm has not expired, print a message every
-        //5 seconds
-        while (alarm->time > time(NULL))
+        //Find the next expiry or periodic message. Alarms handed
+        //over while the mutex was released are due at once.
+        wake.tv_sec = 0;
+        wake.tv_nsec = 0;
+        for (alarm = slot->alarms; alarm != NULL; alarm = alarm->link)
         {
-            printf("Alarm(%d) Printed by Alarm Display Thread %d at %d : %s \n",
-                   alarm->id,
-                   pthread_self(),
-                   time(NULL),
-                   alarm->message);
-            sleep(5);
+            next = alarm->printed + 5 < alarm->time ?
+                   alarm->printed + 5 : alarm->time;
+            if (wake.tv_sec == 0 || next < wake.tv_sec)
+                wake.tv_sec = next;
         }
 
-        //Remove the alarm once it has expired and print a message
-        printf("Alarm Thread Removed Alarm(%d) at %d: %s\n",
-               alarm->id, time(NULL), alarm->message);
-        //unlocks
-        status = pthread_mutex_unlock(&alarm_mutex);
-        if (status != 0)
+        //Wait for a new alarm, or until the next expiry or
+        //periodic message, whichever comes first
+        if (slot->alarms == NULL)
         {
-            err_abort(status, "unlock mutex");
+            status = pthread_cond_wait(&slot->cond, &slot->mutex);
         }
-        free(alarm);
-    }
-}
-//Display 3 start routine
-void *display_thread_three(void *arg)
-{
-    alarm_t *alarm;
-    int status;
-    time_t now;
-
-    //Loop forever, processing alarms. The display thread will
-    //be disintegrated when the process exits.
-    while (1)
-    {
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
+        else if (wake.tv_sec > time(NULL))
         {
-            err_abort(status, "Lock mutex");
-        }
-
-        //Wait for the alarm thread to signal when an alarm is ready to be
-      	//procced.
-        status = pthread_cond_wait(&d3_cond, &alarm_mutex);
-        if (status != 0)
-        {
-            err_abort(status, "wait on cond");
+            status = pthread_cond_timedwait(&slot->cond, &slot->mutex, &wake);
+            if (status == ETIMEDOUT)
+                status = 0;
         }
-        alarm = current_alarm;
-
-        //While the alarm has not expired, print a message every
-        //5 seconds
-        while (alarm->time > time(NULL))
+        else
         {
-            printf("Alarm(%d) Printed by Alarm Display Thread %d at %d : %s \n",
-                   alarm->id,
-                   pthread_self(),
-                   time(NULL),
-                   alarm->message);
-            sleep(5);
+            status = 0;
         }
-        //Remove the alarm once it has expired and print a message
-        printf("Alarm Thread Removed Alarm(%d) at %d: %s\n",
-               alarm->id, time(NULL), alarm->message);
-        //unlocks
-        status = pthread_mutex_unlock(&alarm_mutex);
         if (status != 0)
         {
-            err_abort(status, "unlock mutex");
+            err_abort(status, "wait on cond");
         }
-        free(alarm);
     }
 }
 
@@ -349,28 +787,37 @@ int main(int argc, char *argv[])
     int status;
     char line[128];
     alarm_t *alarm;
-    pthread_t thread;    //alarm thread
-    pthread_t d1_thread; //display thread 1
-    pthread_t d2_thread; //display thread 2
-    pthread_t d3_thread; //display thread 3
-
-    //initialize threads
-    status = pthread_create(
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort(status, "Create alarm thread");
-    status = pthread_create(
-        &d1_thread, NULL, display_thread, NULL);
-    if (status != 0)
-        err_abort(status, "display thread one");
-    status = pthread_create(
-        &d2_thread, NULL, display_thread_two, NULL);
-    if (status != 0)
-        err_abort(status, "display thread two");
-    status = pthread_create(
-        &d3_thread, NULL, display_thread_three, NULL);
+#ifdef DEBUG
+    alarm_t *next;
+#endif
+    output_t output;
+    int priority;
+    int found;
+    int trace_id = 0;
+    int i;
+    long start;
+    char file[128];
+    pthread_t thread;                    //alarm thread
+    pthread_t d_thread[DISPLAY_THREADS]; //display threads
+
+    Parse_Options(argc, argv);
+    Trace_Thread(TRACE_MAIN, "main thread");
+    Open_Output(&output);
+
+    //initialize threads, the display threads first so that their
+    //queues are ready before the alarm thread hands out alarms
+    status = pthread_barrier_init(&display_barrier, NULL, DISPLAY_THREADS + 1);
     if (status != 0)
-        err_abort(status, "display thread three");
+        err_abort(status, "Init barrier");
+    for (i = 0; i < DISPLAY_THREADS; i++)
+        Create_Thread(&d_thread[i], display_thread, (void *)(intptr_t)i,
+                      &display_placement, "Create display thread");
+    status = pthread_barrier_wait(&display_barrier);
+    if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+        err_abort(status, "Wait on barrier");
+    Create_Thread(&thread, alarm_thread, NULL, &alarm_placement,
+                  "Create alarm thread");
+    Set_Alarm_Priority(thread);
     
     while (1)
     {
@@ -379,6 +826,19 @@ int main(int argc, char *argv[])
             exit(0);
         if (strlen(line) <= 1)
             continue;
+        start = Trace_Now();
+
+        //Trace_Dump [file] writes the lifecycle trace
+        if (strncmp(line, "Trace_Dump", 10) == 0)
+        {
+            if (!trace_enabled)
+                fprintf(stderr, "Tracing is off, start with -t\n");
+            else if (sscanf(line, "Trace_Dump %127s", file) == 1)
+                Trace_Dump(file);
+            else
+                Trace_Dump("alarm_trace.json");
+            continue;
+        }
         alarm = (alarm_t *)malloc(sizeof(alarm_t));
         if (alarm == NULL)
             errno_abort("Allocate alarm");
@@ -386,54 +846,95 @@ int main(int argc, char *argv[])
         /*
         * Parse input line into seconds (%d) and a message
         * (%128[^\n]), consisting of up to 128 characters
-        * separated from the seconds by whitespace.
+        * separated from the seconds by whitespace. A Start_Alarm
+        * may give a Priority(%d) before the seconds, otherwise
+        * the alarm has normal priority.
         */
-        if ((sscanf(line, "Start_Alarm(%d) %d %128[^\n]", &alarm->id, &alarm->seconds, alarm->message) < 3) && (sscanf(line, "Change_Alarm(%d) %d %128[^\n]", &alarm->id, &alarm->seconds, alarm->message) < 3))
-        {
-            fprintf(stderr, "Bad command\n");
-            free(alarm);
-            continue;
-        }
-        else if (!(sscanf(line, "Start_Alarm(%d) %d %128[^\n]", &alarm->id, &alarm->seconds, alarm->message) < 3))
+        alarm->priority = PRIORITY_NORMAL;
+        if (sscanf(line, "Start_Alarm(%d) Priority(%d) %d %128[^\n]", &alarm->id, &alarm->priority, &alarm->seconds, alarm->message) == 4 ||
+            sscanf(line, "Start_Alarm(%d) %d %128[^\n]", &alarm->id, &alarm->seconds, alarm->message) == 3)
         {
+            if (alarm->priority < PRIORITY_HIGH || alarm->priority >= PRIORITY_LEVELS)
+            {
+                fprintf(stderr, "Bad priority\n");
+                free(alarm);
+                continue;
+            }
+
+            alarm->trace_id = ++trace_id;
+            alarm->submitted = start;
+            Trace_Span("submit", alarm->id, start);
+
             //locks
-            status = pthread_mutex_lock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Lock mutex");
+            Trace_Lock(&alarm_mutex, alarm->id);
 
             //Calls insert function
-            Insert(&alarm_list, alarm);
+            start = Trace_Now();
+            Insert(&alarm_list[alarm->priority], alarm, &output);
+            alarm->queued = Trace_Now();
+            Trace_Span("insert", alarm->id, start);
 
             //unlocks
             status = pthread_mutex_unlock(&alarm_mutex);
             if (status != 0)
                 err_abort(status, "Unlock_mutex");
         }
-        else
+        else if (sscanf(line, "Change_Alarm(%d) %d %128[^\n]", &alarm->id, &alarm->seconds, alarm->message) == 3)
         {
+            Trace_Span("submit", alarm->id, start);
+
             //locks
-            status = pthread_mutex_lock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Lock mutex");
+            Trace_Lock(&alarm_mutex, alarm->id);
 
-            //Calls change function
-            Change(&alarm_list, alarm);
+            //Calls change function on every priority list, then
+            //on the alarms already handed to display threads
+            start = Trace_Now();
+            for (priority = PRIORITY_HIGH; priority < PRIORITY_LEVELS; priority++)
+            {
+                if (Change(&alarm_list[priority], alarm, &output) != NULL)
+                    break;
+            }
+            for (i = 0; priority == PRIORITY_LEVELS && i < DISPLAY_THREADS; i++)
+            {
+                Trace_Lock(&display[i]->mutex, alarm->id);
+                found = Change_Display(display[i], alarm, &output);
+                status = pthread_mutex_unlock(&display[i]->mutex);
+                if (status != 0)
+                    err_abort(status, "Unlock mutex");
+                if (found)
+                    break;
+            }
+            Trace_Span("change", alarm->id, start);
 
             //unlocks
             status = pthread_mutex_unlock(&alarm_mutex);
             if (status != 0)
                 err_abort(status, "Unlock_mutex");
+            free(alarm);
+        }
+        else
+        {
+            fprintf(stderr, "Bad command\n");
+            free(alarm);
+            continue;
         }
+        Write_Output(&output);
 
 #ifdef DEBUG
-        printf("[list: ");
-        for (next = alarm_list; next != NULL; next = next->link)
-            printf("%d(%d)[\"%s\"] ", next->time,
-                   next->time - time(NULL), next->message);
-        printf("]\n");
-#endif
+        status = pthread_mutex_lock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+        for (priority = PRIORITY_HIGH; priority < PRIORITY_LEVELS; priority++)
+        {
+            printf("[list %d: ", priority);
+            for (next = alarm_list[priority]; next != NULL; next = next->link)
+                printf("%d(%d)[\"%s\"] ", next->time,
+                       next->time - time(NULL), next->message);
+            printf("]\n");
+        }
         status = pthread_mutex_unlock(&alarm_mutex);
         if (status != 0)
             err_abort(status, "Unlock mutex");
+#endif
     }
 }